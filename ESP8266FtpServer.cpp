@@ -21,25 +21,137 @@
 #include "ESP8266FtpServer.h"
 
 #include <time.h>
+#include <ctype.h>
 
 static WiFiServer ftpServer(FTP_CTRL_PORT);
 static WiFiServer dataServer(FTP_DATA_PORT_PASV);
 
 FtpServer::AnonyAuth FtpServer::Anonymous;
 
+// Locate the first occurrence of byte c in [p, end), or return end
+//
+//  After aligning p, scan a 32-bit word at a time: (w - 0x01..) & ~w & 0x80..
+//  is non-zero iff some byte of w is zero, so XOR-ing the word with c repeated
+//  in every byte turns it into a test for c. This keeps ASCII mode translation
+//  close to memcpy speed, since line breaks are sparse in typical text.
+
+static char* scanByte(char* p, char* end, char c)
+{
+  while (p < end && ((uintptr_t)p & (sizeof(uint32_t) - 1))) {
+    if (*p == c) return p;
+    p++;
+  }
+  uint32_t const pattern = 0x01010101UL * (uint8_t)c;
+  while (end - p >= (ptrdiff_t)sizeof(uint32_t)) {
+    uint32_t w;
+    memcpy(&w, p, sizeof(uint32_t));
+    w ^= pattern;
+    if ((w - 0x01010101UL) & ~w & 0x80808080UL) break;
+    p += sizeof(uint32_t);
+  }
+  while (p < end && *p != c) p++;
+  return p;
+}
+
+// Compute the rsync style weak checksum of a block
+
+static uint32_t weakChecksum(uint8_t const* p, size_t len)
+{
+  uint32_t a = 0, b = 0;
+  for (size_t i = 0; i < len; i++) {
+    a += p[ i ];
+    b += (len - i) * p[ i ];
+  }
+  return (a & 0xFFFF) | (b << 16);
+}
+
+// FNV-1a hash of a string, for stat cache lookups; case is ignored, as
+// FAT file systems do
+
+static uint32_t hashPath(char const* p)
+{
+  uint32_t h = 2166136261UL;
+  while (*p)
+    h = (h ^ (uint8_t) tolower((uint8_t) *p++)) * 16777619UL;
+  return h;
+}
+
+// Length of a delta operation header, by opcode
+
+static uint8_t deltaHdrSize(uint8_t op)
+{
+  return op == 'C'? 9 : op == 'E'? 21 : 5;
+}
+
+static uint32_t getU32(uint8_t const* p)
+{
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+// Append the components of src to the canonical path of length len
+//
+//  Empty and "." components are skipped, ".." drops the last component
+//  (staying at root). A canonical path has no trailing slash, so root is
+//  the empty path.
+//
+//  return: false if the result would exceed FTP_FIL_SIZE
+
+static bool appendPath(char* path, size_t& len, char const* src)
+{
+  while (*src) {
+    char const* comp = src;
+    while (*src && *src != '/') src++;
+    size_t clen = src - comp;
+    if (*src) src++;
+
+    if (clen == 0 || (clen == 1 && comp[0] == '.'))
+      continue;
+    if (clen == 2 && comp[0] == '.' && comp[1] == '.') {
+      while (len > 0 && path[ len - 1 ] != '/') len--;
+      if (len > 0) len--;
+      continue;
+    }
+    if (len + 1 + clen > FTP_FIL_SIZE)
+      return false;
+    path[ len++ ] = '/';
+    memcpy(path + len, comp, clen);
+    len += clen;
+  }
+  return true;
+}
+
 void FtpServer::begin()
 {
   dataServer.begin();
   cmdStatus = 0;
 }
 
+void FtpServer::setFlushPolicy(FlushPolicy policy, size_t interval)
+{
+  _flushPolicy = interval? policy : FLUSH_ON_CLOSE;
+  _flushInterval = interval;
+}
+
+void FtpServer::setMonitor(Monitor* monitor)
+{
+  _monitor = monitor;
+}
+
+void FtpServer::setTracer(Tracer* tracer)
+{
+  _tracer = tracer;
+}
+
 void FtpServer::iniVariables()
 {
   // Set the root directory
   dir = _fs.openDir("/");
 
-  renameFrom.clear();
+  renameFrom[ 0 ] = 0;
+  statClear();
   transferStatus = 0;
+  asciiMode = false;
+  restartPos = 0;
 }
 
 void FtpServer::handleFTP()
@@ -81,6 +193,8 @@ void FtpServer::handleFTP()
     #ifdef FTP_DEBUG
     Serial.println("> "+String(command)+(parameters?' '+String(parameters):""));
     #endif
+    if (_tracer)
+      _tracer->traceCommand(millis(), command, parameters);
     if (cmdStatus == 3) {          // Ftp server waiting for user identity
       if (userIdentity())
         cmdStatus = 4;
@@ -102,7 +216,12 @@ void FtpServer::handleFTP()
     Serial.println("* Client disconnected");
   }
 
-  if (transferStatus == 1)         // Retrieve data
+  if (transferStatus > 0 && _monitor && !_monitor->transferReady())
+  {
+    // Transfer held by application, keep connection alive meanwhile
+    tsEndConnection = time(NULL) + FTP_IDLE_TIME_OUT;
+  }
+  else if (transferStatus == 1)    // Retrieve data
   {
     tsEndConnection = time(NULL) + FTP_IDLE_TIME_OUT;
     doRetrieve();
@@ -112,10 +231,25 @@ void FtpServer::handleFTP()
     tsEndConnection = time(NULL) + FTP_IDLE_TIME_OUT;
     doStore();
   }
+  else if (transferStatus == 3)    // Send block signatures
+  {
+    tsEndConnection = time(NULL) + FTP_IDLE_TIME_OUT;
+    doSignature();
+  }
+  else if (transferStatus == 4)    // Store delta
+  {
+    tsEndConnection = time(NULL) + FTP_IDLE_TIME_OUT;
+    doDelta();
+  }
+  else if (transferStatus == 5)    // List directory
+  {
+    tsEndConnection = time(NULL) + FTP_IDLE_TIME_OUT;
+    doList();
+  }
   else if (cmdStatus > 2 && (tsEndConnection < time(NULL)))
   {
     Serial.println("* Client timeout");
-    client.println("530 Timeout");
+    reply("530 Timeout");
     cmdStatus = 0;
   }
 }
@@ -125,7 +259,7 @@ void FtpServer::clientConnected()
   #ifdef FTP_DEBUG
   Serial.println("Client connected!");
   #endif
-  client.println("220 Welcome to ESP8266 FTP "+ String(FTP_SERVER_VERSION));
+  reply("220 Welcome to ESP8266 FTP "+ String(FTP_SERVER_VERSION));
   iCL = 0;
 }
 
@@ -135,22 +269,22 @@ void FtpServer::disconnectClient()
   Serial.println(" Disconnecting client");
   #endif
   abortTransfer();
-  client.println("221 Goodbye");
+  reply("221 Goodbye");
   client.stop();
 }
 
 boolean FtpServer::userIdentity()
 {
   if (strcmp(command, "USER"))
-    client.println("500 Expect authentication");
+    reply("500 Expect authentication");
   else if (!_auth.setUser(parameters)) {
     #ifdef FTP_DEBUG
     Serial.println("Invalid user account");
     #endif
-    client.println("530 User not found");
+    reply("530 User not found");
   } else {
     Serial.println("Logging on user: "+String(parameters));
-    client.println("331 OK. Password required");
+    reply("331 OK. Password required");
     return true;
   }
   return false;
@@ -159,13 +293,13 @@ boolean FtpServer::userIdentity()
 boolean FtpServer::userPassword()
 {
   if (strcmp(command, "PASS"))
-    client.println("500 Expect authentication");
+    reply("500 Expect authentication");
   else if (!_auth.checkPass(parameters)) {
     Serial.println("Incorrect user password");
-    client.println("530 Incorrect password");
+    reply("530 Incorrect password");
   } else {
     Serial.println("User logged in, waiting for commands...");
-    client.println("230 OK. Authenticated");
+    reply("230 OK. Authenticated");
     return true;
   }
   return false;
@@ -173,6 +307,8 @@ boolean FtpServer::userPassword()
 
 boolean FtpServer::processCommand()
 {
+  char const* path;
+
   ///////////////////////////////////////
   //                                   //
   //      ACCESS CONTROL COMMANDS      //
@@ -184,7 +320,17 @@ boolean FtpServer::processCommand()
   //
   if (!strcmp(command, "CDUP"))
   {
-    client.println("250 Ok. Current directory is " + String(dir.name()));
+    if (!(path = resolvePath("..")))
+      reply("553 Path too long");
+    else {
+      Dir _dir = _fs.openDir(path);
+      if (_dir.name()) {
+        dir = _dir;
+        reply("250 Ok. Current directory is " + String(dir.name()));
+      } else {
+        reply("550 Parent directory not accessible");
+      }
+    }
   }
   //
   //  CWD - Change Working Directory
@@ -192,14 +338,16 @@ boolean FtpServer::processCommand()
   else if (!strcmp(command, "CWD"))
   {
     if (strcmp(parameters, ".") == 0)  // 'CWD .' is the same as PWD command
-      client.println("257 \"" + String(dir.name()) + "\" is your current directory");
+      reply("257 \"" + String(dir.name()) + "\" is your current directory");
+    else if (!(path = resolvePath(parameters)))
+      reply("553 Path too long");
     else {
-      Dir _dir = (*parameters != '/')? dir.openDir(parameters) : _fs.openDir(parameters);
+      Dir _dir = _fs.openDir(path);
       if (_dir.name()) {
         dir = _dir;
-        client.println("250 Ok. Current directory is " + String(dir.name()));
+        reply("250 Ok. Current directory is " + String(dir.name()));
       } else {
-        client.println("550 Directory \""+String(parameters)+"\" not found");
+        reply("550 Directory \""+String(parameters)+"\" not found");
       }
     }
   }
@@ -207,7 +355,7 @@ boolean FtpServer::processCommand()
   //  PWD - Print Directory
   //
   else if (!strcmp(command, "PWD"))
-    client.println("257 \"" + String(dir.name()) + "\" is your current directory");
+    reply("257 \"" + String(dir.name()) + "\" is your current directory");
   //
   //  QUIT
   //
@@ -229,9 +377,9 @@ boolean FtpServer::processCommand()
   else if (!strcmp(command, "MODE"))
   {
     if (!strcmp(parameters, "S"))
-      client.println("200 S Ok");
+      reply("200 S Ok");
     else
-      client.println("504 Only S(tream) mode is supported");
+      reply("504 Only S(tream) mode is supported");
   }
   //
   //  PASV - Passive Connection management
@@ -245,7 +393,7 @@ boolean FtpServer::processCommand()
     //Serial.println("Connection management set to passive");
     //Serial.println("Data port set to " + String(dataPort));
     #endif
-    client.println("227 Entering Passive Mode ("+ String(dataIp[0]) + "," + String(dataIp[1])+","+ String(dataIp[2])+","+ String(dataIp[3])+","+String(dataPort >> 8) +","+String (dataPort & 255)+").");
+    reply("227 Entering Passive Mode ("+ String(dataIp[0]) + "," + String(dataIp[1])+","+ String(dataIp[2])+","+ String(dataIp[3])+","+String(dataPort >> 8) +","+String (dataPort & 255)+").");
   }
   //
   //  STRU - File Structure
@@ -253,21 +401,24 @@ boolean FtpServer::processCommand()
   else if (!strcmp(command, "STRU"))
   {
     if (!strcmp(parameters, "F"))
-      client.println("200 F Ok");
+      reply("200 F Ok");
     else
-      client.println("504 Only F(ile) structure is supported");
+      reply("504 Only F(ile) structure is supported");
   }
   //
   //  TYPE - Data Type
   //
   else if (!strcmp(command, "TYPE"))
   {
-    if (!strcmp(parameters, "A"))
-      client.println("200 TYPE is now ASII");
-    else if (!strcmp(parameters, "I"))
-      client.println("200 TYPE is now 8-bit binary");
+    if (!strcmp(parameters, "A")) {
+      asciiMode = true;
+      reply("200 TYPE is now ASCII");
+    } else if (!strcmp(parameters, "I")) {
+      asciiMode = false;
+      reply("200 TYPE is now 8-bit binary");
+    }
     else
-      client.println("504 Unknown TYPE");
+      reply("504 Unknown TYPE");
   }
 
   ///////////////////////////////////////
@@ -282,7 +433,24 @@ boolean FtpServer::processCommand()
   else if (!strcmp(command, "ABOR"))
   {
     abortTransfer();
-    client.println("226 Data connection closed");
+    reply("226 Data connection closed");
+  }
+  //
+  //  ALLO - Allocate storage
+  //
+  else if (!strcmp(command, "ALLO"))
+  {
+    char * end = parameters;
+    uint32_t size = strlen(parameters)? strtoul(parameters, &end, 10) : 0;
+    FSInfo info;
+    if (end == parameters || (*end != 0 && *end != ' '))
+      reply("501 Invalid allocation size");
+    else if (!_fs.info(info))
+      reply("202 No storage allocation necessary");
+    else if (size > info.totalBytes - info.usedBytes)
+      reply("552 Insufficient storage space");
+    else
+      reply("200 " + String(size) + " bytes available");
   }
   //
   //  DELE - Delete a File
@@ -290,107 +458,41 @@ boolean FtpServer::processCommand()
   else if (!strcmp(command, "DELE"))
   {
     if (strlen(parameters) == 0)
-      client.println("501 No file name");
+      reply("501 No file name");
+    else if (!(path = resolvePath(parameters)))
+      reply("553 Path too long");
     else
     {
-      String dirName = String(dir.name());
-      String removeEntry = (*parameters != '/')? dirName+(dirName.length()>1?"/":"")+parameters : parameters;
-      bool res = _fs.remove(removeEntry.c_str());
+      bool res = _fs.remove(path);
       if (res) {
-        Serial.println("* Deleted " + removeEntry);
-        client.println("250 Deleted " + String(parameters));
+        statInvalidate(path);
+        Serial.println("* Deleted " + String(path));
+        reply("250 Deleted " + String(parameters));
       } else
-        client.println("450 Can't delete " + String(parameters));
+        reply("450 Can't delete " + String(parameters));
     }
   }
   //
   //  LIST - List
-  //
-  else if (!strcmp(command, "LIST"))
-  {
-    if (!dataConnect())
-      client.println("425 No data connection");
-    else
-    {
-      client.println("150 Accepted data connection");
-      uint16_t nm = 0;
-      if (dir.next(true))
-        do {
-          String fn = dir.entryName();
-          bool isDir = dir.isEntryDir();
-          size_t fs = dir.entrySize();
-          time_t fm = dir.entryMtime();
-          // EPLF format: https://cr.yp.to/ftp/list/eplf.html
-          //String listdata = "+m"+String(fm)+','+(isDir?'/':'r')+",s"+String(fs)+",\t"+fn;
-          struct tm tpart;
-          gmtime_r(&fm, &tpart);
-          char tbuf[16];
-          strftime(tbuf, 16, "%b %d %Y", &tpart);
-          String listdata = String(isDir?"drwxr-xr-x":"-rw-r--r--") + " 1 root root "
-                            + String(fs) + ' '+ tbuf + ' ' + fn;
-          #ifdef FTP_DEBUG
-          Serial.println(listdata);
-          #endif
-          data.println(listdata);
-          nm++;
-        } while(dir.next());
-      client.println("226 " + String(nm) + " matches total");
-      data.stop();
-    }
-  }
-  //
   //  MLSD - Listing for Machine Processing (see RFC 3659)
-  //
-  else if (!strcmp(command, "MLSD"))
-  {
-    if (!dataConnect())
-      client.println("425 No data connection MLSD");
-    else
-    {
-      client.println("150 Accepted data connection");
-      uint16_t nm = 0;
-      if (dir.next(true))
-        do {
-          String fn = dir.entryName();
-          bool isDir = dir.isEntryDir();
-          size_t fs = dir.entrySize();
-          time_t fm = dir.entryMtime();
-          // https://tools.ietf.org/html/rfc3659
-          struct tm tpart;
-          gmtime_r(&fm, &tpart);
-          char tbuf[16];
-          sprintf(tbuf, "%04d%02d%02d%02d%02d%02d",
-                  tpart.tm_year + 1900, tpart.tm_mon + 1, tpart.tm_mday,
-                  tpart.tm_hour, tpart.tm_min, tpart.tm_sec);
-          String listdata = "Size="+String(fs)+";Modify="+String(tbuf)+";Type="+(isDir?"dir":"file")+"; "+fn;
-          #ifdef FTP_DEBUG
-          Serial.println(listdata);
-          #endif
-          data.println(listdata);
-          nm++;
-        } while(dir.next());
-      client.println("226 " + String(nm) + " matches total");
-      data.stop();
-    }
-  }
-  //
   //  NLST - Name List
   //
-  else if (!strcmp(command, "NLST"))
+  //  Entries are sent from handleFTP() a buffer at a time, see doList()
+  //
+  else if (!strcmp(command, "LIST") || !strcmp(command, "MLSD") || !strcmp(command, "NLST"))
   {
     if (!dataConnect())
-      client.println("425 No data connection");
+      reply("425 No data connection");
     else
     {
-      client.println("150 Accepted data connection");
-      uint16_t nm = 0;
-      if (dir.next(true))
-        do {
-          data.println(dir.entryName());
-          nm++;
-        } while(dir.next());
-      client.println("226 " + String(nm) + " matches total");
-      data.stop();
+      reply("150 Accepted data connection");
+      // Keep the directory, CWD may be processed while listing
+      listDir = dir;
+      listFormat = command[ 0 ];
+      listCount = 0;
+      // Cache the metadata of the directory being listed
+      statClear();
+      startTransfer(5);
     }
   }
   //
@@ -398,14 +500,29 @@ boolean FtpServer::processCommand()
   //
   else if (!strcmp(command, "NOOP"))
   {
-    client.println("200 Zzz...");
+    reply("200 Zzz...");
   }
   //
   //  SYST
   //
   else if (!strcmp(command, "SYST"))
   {
-    client.println("215 UNIX Type: L8");
+    reply("215 UNIX Type: L8");
+  }
+  //
+  //  REST - Restart transfer at offset (see RFC 3659)
+  //
+  else if (!strcmp(command, "REST"))
+  {
+    char * end = parameters;
+    uint32_t pos = strlen(parameters)? strtoul(parameters, &end, 10) : 0;
+    if (end == parameters || *end != 0)
+      reply("501 Invalid restart position");
+    else {
+      restartPos = pos;
+      reply("350 Restarting at " + String(restartPos));
+    }
+    return true;
   }
   //
   //  RETR - Retrieve
@@ -413,25 +530,33 @@ boolean FtpServer::processCommand()
   else if (!strcmp(command, "RETR"))
   {
     if (strlen(parameters) == 0)
-      client.println("501 No file name");
+      reply("501 No file name");
+    else if (restartPos && asciiMode)
+      // A restart offset counts bytes of the ASCII representation, which
+      // does not map to a stored file offset (RFC 3659, section 5)
+      reply("554 Restart not supported in ASCII mode");
+    else if (!(path = resolvePath(parameters)))
+      reply("553 Path too long");
     else {
-      File _file = (*parameters != '/')? dir.openFile(parameters,"r") : _fs.open(parameters,"r");
-      if (_file.name()) {
+      File _file = _fs.open(path,"r");
+      if (!_file.name()) {
+        reply("550 File " +String(parameters)+ " not found");
+      } else if (restartPos > _file.size() || !_file.seek(restartPos, SeekSet)) {
+        reply("554 Invalid restart position");
+      } else {
         if (dataConnect()) {
           file = _file;
           Serial.println("* Sending " + String(file.name()));
-          #ifdef FTP_DEBUG
-          tsBeginTrans = time(NULL);
-          bytesTransfered = 0;
-          #endif
-          client.println("150-Data connection established");
-          client.println("150 " + String(file.size()) + " bytes to download");
-          transferStatus = 1;
+          reply("150-Data connection established");
+          if (asciiMode)
+            reply("150 Sending in ASCII mode");
+          else
+            reply("150 " + String(file.size() - restartPos) + " bytes to download");
+          lastCR = false;
+          startTransfer(1);
         } else {
-          client.println("425 No data connection");
+          reply("425 No data connection");
         }
-      } else {
-        client.println("550 File " +String(parameters)+ " not found");
       }
     }
   }
@@ -441,24 +566,27 @@ boolean FtpServer::processCommand()
   else if (!strcmp(command, "STOR"))
   {
     if (strlen(parameters) == 0)
-      client.println("501 No file name");
+      reply("501 No file name");
+    else if (restartPos)
+      reply("554 Restart not supported for upload");
+    else if (!(path = resolvePath(parameters)))
+      reply("553 Path too long");
     else {
-      File _file = (*parameters != '/')? dir.openFile(parameters,"w") : _fs.open(parameters,"w");
+      statInvalidate(path);
+      File _file = _fs.open(path,"w");
       if (_file.name()) {
         if (dataConnect()) {
           file = _file;
           Serial.println("* Receiving " +String(file.name()));
-          #ifdef FTP_DEBUG
-          tsBeginTrans = time(NULL);
-          bytesTransfered = 0;
-          #endif
-          client.println("150 Data connection established");
-          transferStatus = 2;
+          reply("150 Data connection established");
+          pendingCR = false;
+          unflushed = 0;
+          startTransfer(2);
         } else {
-          client.println("425 No data connection");
+          reply("425 No data connection");
         }
       } else {
-        client.println("451 Can't open/create " +String(parameters));
+        reply("451 Can't open/create " +String(parameters));
       }
     }
   }
@@ -467,11 +595,17 @@ boolean FtpServer::processCommand()
   //
   else if (!strcmp(command, "MKD"))
   {
-    Dir _dir = (*parameters != '/')? dir.openDir(parameters, true) : _fs.openDir(parameters, true);
-    if (_dir.name()) {
-      client.println("257 Create directory " + String(parameters));
-    } else {
-      client.println("550 Failed to create directory");
+    if (strlen(parameters) == 0)
+      reply("501 No directory name");
+    else if (!(path = resolvePath(parameters)))
+      reply("553 Path too long");
+    else {
+      Dir _dir = _fs.openDir(path, true);
+      if (_dir.name()) {
+        reply("257 Create directory " + String(parameters));
+      } else {
+        reply("550 Failed to create directory");
+      }
     }
   }
   //
@@ -479,11 +613,18 @@ boolean FtpServer::processCommand()
   //
   else if (!strcmp(command, "RMD"))
   {
-    bool res = (*parameters != '/')? dir.remove(parameters) : _fs.remove(parameters);
-    if (res) {
-      client.println("250 Removed Directory " + String(parameters));
-    } else {
-      client.println("550 Failed to remove directory");
+    if (strlen(parameters) == 0)
+      reply("501 No directory name");
+    else if (!(path = resolvePath(parameters)))
+      reply("553 Path too long");
+    else {
+      bool res = _fs.remove(path);
+      if (res) {
+        statInvalidate(path);
+        reply("250 Removed Directory " + String(parameters));
+      } else {
+        reply("550 Failed to remove directory");
+      }
     }
   }
   //
@@ -491,20 +632,21 @@ boolean FtpServer::processCommand()
   //
   else if (!strcmp(command, "RNFR"))
   {
+    renameFrom[ 0 ] = 0;
     if (strlen(parameters) == 0)
-      client.println("501 No file name");
+      reply("501 No file name");
+    else if (!(path = resolvePath(parameters)))
+      reply("553 Path too long");
     else {
-       String dirName = String(dir.name());
-      renameFrom = (*parameters != '/')? dirName+(dirName.length()>1?"/":"")+parameters : parameters;
-      bool res = _fs.exists(renameFrom);
+      bool res = statLookup(path) || _fs.exists(path);
       if (res) {
+        strcpy(renameFrom, path);
         #ifdef FTP_DEBUG
-        Serial.println("Renaming from " + renameFrom);
+        Serial.println("Renaming from " + String(renameFrom));
         #endif
-        client.println("350 RNFR accepted - file exists, ready for destination");
+        reply("350 RNFR accepted - file exists, ready for destination");
       } else {
-        renameFrom.clear();
-        client.println("550 File " +String(parameters)+ " not found");
+        reply("550 File " +String(parameters)+ " not found");
       }
     }
   }
@@ -514,28 +656,30 @@ boolean FtpServer::processCommand()
   else if (!strcmp(command, "RNTO"))
   {
     if (strlen(parameters) == 0)
-      client.println("501 No file name");
-    else if (renameFrom.empty())
-      client.println("503 Need RNFR before RNTO");
+      reply("501 No file name");
+    else if (!renameFrom[ 0 ])
+      reply("503 Need RNFR before RNTO");
+    else if (!(path = resolvePath(parameters)))
+      reply("553 Path too long");
     else {
-      String dirName = String(dir.name());
-      String renameTo = (*parameters != '/')? dirName+(dirName.length()>1?"/":"")+parameters : parameters;
       #ifdef FTP_DEBUG
-      Serial.println("Renaming to " + renameTo);
+      Serial.println("Renaming to " + String(path));
       #endif
-      bool res = _fs.exists(renameTo);
+      bool res = statLookup(path) || _fs.exists(path);
       if (res) {
-        client.println("553 Target file/directory exists");
+        reply("553 Target file/directory exists");
       } else {
-        res = _fs.rename(renameFrom, renameTo);
+        res = _fs.rename(renameFrom, path);
         if (res) {
-          client.println("250 File successfully renamed or moved");
+          statInvalidate(renameFrom);
+          statInvalidate(path);
+          reply("250 File successfully renamed or moved");
         } else {
-          client.println("550 Rename/move failure");
+          reply("550 Rename/move failure");
         }
       }
     }
-    renameFrom.clear();
+    renameFrom[ 0 ] = 0;
   }
 
   ///////////////////////////////////////
@@ -549,11 +693,12 @@ boolean FtpServer::processCommand()
   //
   else if (!strcmp(command, "FEAT"))
   {
-    client.println("211-Extensions supported:");
-    client.println(" MLSD");
-    client.println(" MDTM");
-    client.println(" SIZE");
-    client.println("211 End.");
+    reply("211-Extensions supported:");
+    reply(" MLSD");
+    reply(" MDTM");
+    reply(" REST STREAM");
+    reply(" SIZE");
+    reply("211 End.");
   }
   //
   //  MDTM - File Modification Time (see RFC 3659)
@@ -561,20 +706,26 @@ boolean FtpServer::processCommand()
   else if (!strcmp(command, "MDTM"))
   {
     if (strlen(parameters) == 0)
-    client.println("501 No file name");
+    reply("501 No file name");
+    else if (!(path = resolvePath(parameters)))
+      reply("553 Path too long");
     else {
-      File _file = (*parameters != '/')? dir.openFile(parameters,"r") : _fs.open(parameters,"r");
-      if (_file.name()) {
-        time_t fm = _file.mtime();
+      // Directories are answered by the file system, as with SIZE
+      StatEntry const* st = statLookup(path);
+      File _file;
+      if (!st || st->isDir)
+        _file = _fs.open(path,"r");
+      if ((st && !st->isDir) || _file.name()) {
+        time_t fm = (st && !st->isDir)? st->mtime : _file.mtime();
         struct tm tpart;
         gmtime_r(&fm, &tpart);
         char tbuf[16];
         sprintf(tbuf, "%04d%02d%02d%02d%02d%02d",
                 tpart.tm_year + 1900, tpart.tm_mon + 1, tpart.tm_mday,
                 tpart.tm_hour, tpart.tm_min, tpart.tm_sec);
-        client.println("213 " +String(tbuf));
+        reply("213 " +String(tbuf));
       } else {
-        client.println("550 File " +String(parameters)+ " not found");
+        reply("550 File " +String(parameters)+ " not found");
       }
     }
   }
@@ -585,14 +736,103 @@ boolean FtpServer::processCommand()
   else if (!strcmp(command, "SIZE"))
   {
     if (strlen(parameters) == 0)
-    client.println("501 No file name");
+    reply("501 No file name");
+    else if (asciiMode)
+      // The ASCII size differs from the stored size, and is unknown without
+      // reading through the file (RFC 3659, section 4)
+      reply("550 SIZE not available in ASCII mode");
+    else if (!(path = resolvePath(parameters)))
+      reply("553 Path too long");
     else {
-      File _file = (*parameters != '/')? dir.openFile(parameters,"r") : _fs.open(parameters,"r");
-      if (_file.name()) {
-        size_t fs = _file.size();
-        client.println("213 " +String(fs));
+      StatEntry const* st = statLookup(path);
+      File _file;
+      if (!st || st->isDir)
+        _file = _fs.open(path,"r");
+      if ((st && !st->isDir) || _file.name()) {
+        size_t fs = (st && !st->isDir)? st->size : _file.size();
+        reply("213 " +String(fs));
+      } else {
+        reply("550 File " +String(parameters)+ " not found");
+      }
+    }
+  }
+
+  ///////////////////////////////////////
+  //                                   //
+  //          SITE EXTENSIONS          //
+  //                                   //
+  ///////////////////////////////////////
+
+  //
+  //  SITE SIGN <block size> <file> - Send block signatures of a file
+  //  SITE DELTA <block size> <file> - Rebuild a file from a delta upload
+  //
+  //  Signatures are sent one text line per block: the rsync style weak
+  //  checksum (8 hex digits), a space, and the MD5 of the block.
+  //  A delta is a binary stream of operations, with big-endian integers:
+  //    'C' <index:4> <count:4>  copy count blocks from block index of the file
+  //    'L' <length:4> <data>    insert length bytes of literal data
+  //    'E' <length:4> <MD5:16>  end of delta, with length and MD5 of the result
+  //  Copies must lie within the file; only its last block may be short.
+  //  The result is built in a temporary file <file>.~dl, which replaces the
+  //  original only when the end operation arrives and matches the result.
+  //  Anything else, including the data connection closing early, discards it.
+  //
+  else if (!strcmp(command, "SITE"))
+  {
+    char * args = strchr(parameters, ' ');
+    char * end = args;
+    if (args)
+      *args++ = 0;                 // split off sub-command
+    uint32_t block = args? strtoul(args, &end, 10) : 0;
+    bool sign = !strcasecmp(parameters, "SIGN");
+    if (!sign && strcasecmp(parameters, "DELTA"))
+      reply("504 Unknown SITE command");
+    else if (!args || end == args || *end != ' ' || block < 16 || block > FTP_BUF_SIZE)
+      reply("501 Expect block size and file name");
+    else if (!(path = resolvePath(end + 1)))
+      reply("553 Path too long");
+    else if (!sign && strlen(path) + strlen(FTP_DELTA_SUFFIX) > FTP_FIL_SIZE)
+      reply("553 Path too long");
+    else {
+      File _file = _fs.open(path,"r");
+      if (!_file.name()) {
+        reply("550 File " + String(end + 1) + " not found");
+      } else if (sign) {
+        if (dataConnect()) {
+          file = _file;
+          deltaBlock = block;
+          Serial.println("* Signing " + String(file.name()));
+          reply("150 Sending block signatures");
+          startTransfer(3);
+        } else {
+          reply("425 No data connection");
+        }
       } else {
-        client.println("550 File " +String(parameters)+ " not found");
+        strcpy(deltaPath, path);
+        strcat(pathBuf, FTP_DELTA_SUFFIX);
+        // Never clobber a user file that happens to have the temporary name
+        File _temp = _fs.exists(pathBuf)? File() : _fs.open(pathBuf,"w");
+        if (!_temp.name()) {
+          reply("450 Can't create temporary file " + String(pathBuf));
+        } else if (dataConnect()) {
+          statInvalidate(deltaPath);
+          srcFile = _file;
+          file = _temp;
+          deltaBlock = block;
+          deltaRemain = 0;
+          deltaHdrLen = 0;
+          deltaSize = 0;
+          deltaMd5.begin();
+          unflushed = 0;
+          Serial.println("* Receiving delta for " + String(deltaPath));
+          reply("150 Ready for delta");
+          startTransfer(4);
+        } else {
+          _temp.close();
+          _fs.remove(pathBuf);
+          reply("425 No data connection");
+        }
       }
     }
   }
@@ -600,11 +840,32 @@ boolean FtpServer::processCommand()
   //  Unrecognized commands ...
   //
   else
-    client.println("500 Unknown command");
+    reply("500 Unknown command");
 
+  // A restart position only applies to the command right after REST
+  restartPos = 0;
   return true;
 }
 
+// Resolve a path sent by the client against the current directory
+//
+//  The canonical absolute path is built in pathBuf, without heap allocation.
+//
+//  return: pathBuf, or NULL if the path is longer than FTP_FIL_SIZE
+
+char const* FtpServer::resolvePath(char const* param)
+{
+  size_t len = 0;
+  if (*param != '/' && !appendPath(pathBuf, len, dir.name()))
+    return NULL;
+  if (!appendPath(pathBuf, len, param))
+    return NULL;
+  if (len == 0)
+    pathBuf[ len++ ] = '/';
+  pathBuf[ len ] = 0;
+  return pathBuf;
+}
+
 boolean FtpServer::dataConnect()
 {
   data.stop();
@@ -620,18 +881,47 @@ boolean FtpServer::dataConnect()
   return data.connected();
 }
 
+void FtpServer::startTransfer(int8_t status)
+{
+  tsBeginTrans = millis();
+  bytesTransfered = 0;
+  transferStatus = status;
+  if (_monitor)
+    _monitor->transferStart(status == 5? listDir.name() : file.name(), isUpload());
+}
+
+void FtpServer::reportProgress(size_t nb)
+{
+  bytesTransfered += nb;
+  if (_monitor) {
+    uint32_t deltaT = millis() - tsBeginTrans;
+    uint32_t rate = deltaT? (uint64_t) bytesTransfered * 1000 / deltaT : 0;
+    _monitor->transferProgress(bytesTransfered, rate);
+  }
+}
+
 boolean FtpServer::doRetrieve()
 {
   if (data.connected())
   {
-    int16_t nb = file.readBytes(buf, FTP_BUF_SIZE);
+    size_t len = FTP_BUF_SIZE;
+    #ifdef FTP_WINDOWED_SEND
+    // Only read what the network stack can take right now, so the write
+    // lands directly in its send buffer instead of stalling for ACKs
+    len = data.availableForWrite();
+    if (len == 0)
+      return true;
+    if (len > FTP_BUF_SIZE)
+      len = FTP_BUF_SIZE;
+    #endif
+    int16_t nb = asciiMode? readAscii(len) : file.readBytes(buf, len);
     if (nb > 0)
     {
       data.write((uint8_t*) buf, nb);
       #ifdef FTP_DEBUG
       Serial.println("Sent "+String(nb)+" bytes") ;
-      bytesTransfered += nb;
       #endif
+      reportProgress(nb);
       return true;
     }
   }
@@ -646,11 +936,11 @@ boolean FtpServer::doStore()
     int16_t nb = data.readBytes(buf, FTP_BUF_SIZE);
     if (nb > 0)
     {
-      file.write((uint8_t*) buf, nb);
+      storeBytes(asciiMode? storeAscii(nb) : nb);
       #ifdef FTP_DEBUG
       Serial.println("Received "+String(nb)+" bytes") ;
-      bytesTransfered += nb;
       #endif
+      reportProgress(nb);
     }
     return true;
   }
@@ -658,17 +948,310 @@ boolean FtpServer::doStore()
   return false;
 }
 
+// Write the first nb bytes of buf to file, flushing as the policy requires
+
+void FtpServer::storeBytes(size_t nb)
+{
+  file.write((uint8_t*) buf, nb);
+  if (_flushPolicy == FLUSH_INTERVAL) {
+    unflushed += nb;
+    if (unflushed >= _flushInterval) {
+      file.flush();
+      unflushed = 0;
+    }
+  }
+}
+
+// Store the first nb bytes of buf as rebuilt delta output
+
+void FtpServer::storeDelta(size_t nb)
+{
+  storeBytes(nb);
+  deltaMd5.add((uint8_t*) buf, nb);
+  deltaSize += nb;
+}
+
+// Send the next batch of directory entries
+//
+//  Entries are formatted into buf until it may not hold another one, so a
+//  large directory neither blocks the loop nor costs a write per entry.
+
+boolean FtpServer::doList()
+{
+  if (data.connected())
+  {
+    size_t len = 0;
+    bool more = true;
+    while (len + FTP_FIL_SIZE + 64 <= FTP_BUF_SIZE)
+    {
+      if (!(more = listCount? listDir.next() : listDir.next(true)))
+        break;
+      String fn = listDir.entryName();
+      bool isDir = listDir.isEntryDir();
+      size_t fs = listDir.entrySize();
+      time_t fm = listDir.entryMtime();
+      size_t plen = 0;
+      if (fn != "." && fn != ".."
+          && appendPath(pathBuf, plen, listDir.name()) && appendPath(pathBuf, plen, fn.c_str())) {
+        pathBuf[ plen ] = 0;
+        statInsert(pathBuf, fs, fm, isDir);
+      }
+      struct tm tpart;
+      gmtime_r(&fm, &tpart);
+      char tbuf[16];
+      int nb;
+      if (listFormat == 'L') {
+        // EPLF format: https://cr.yp.to/ftp/list/eplf.html
+        //String listdata = "+m"+String(fm)+','+(isDir?'/':'r')+",s"+String(fs)+",\t"+fn;
+        strftime(tbuf, 16, "%b %d %Y", &tpart);
+        nb = snprintf(buf + len, FTP_BUF_SIZE - len, "%s 1 root root %lu %s %s\r\n",
+                      isDir?"drwxr-xr-x":"-rw-r--r--", (unsigned long) fs, tbuf, fn.c_str());
+      } else if (listFormat == 'M') {
+        // https://tools.ietf.org/html/rfc3659
+        sprintf(tbuf, "%04d%02d%02d%02d%02d%02d",
+                tpart.tm_year + 1900, tpart.tm_mon + 1, tpart.tm_mday,
+                tpart.tm_hour, tpart.tm_min, tpart.tm_sec);
+        nb = snprintf(buf + len, FTP_BUF_SIZE - len, "Size=%lu;Modify=%s;Type=%s; %s\r\n",
+                      (unsigned long) fs, tbuf, isDir?"dir":"file", fn.c_str());
+      } else {
+        nb = snprintf(buf + len, FTP_BUF_SIZE - len, "%s\r\n", fn.c_str());
+      }
+      #ifdef FTP_DEBUG
+      Serial.print(buf + len);
+      #endif
+      if (nb > 0)
+        len += (size_t) nb < FTP_BUF_SIZE - len? nb : FTP_BUF_SIZE - len - 1;
+      listCount++;
+    }
+    if (len)
+    {
+      data.write((uint8_t*) buf, len);
+      reportProgress(len);
+    }
+    if (more)
+      return true;
+  }
+  closeTransfer();
+  return false;
+}
+
+boolean FtpServer::doSignature()
+{
+  if (data.connected())
+  {
+    int16_t nb = file.readBytes(buf, deltaBlock);
+    if (nb > 0)
+    {
+      MD5Builder md5;
+      md5.begin();
+      md5.add((uint8_t*) buf, nb);
+      md5.calculate();
+      char line[ 8 + 1 + 32 + 1 ];
+      sprintf(line, "%08lx ", (unsigned long) weakChecksum((uint8_t*) buf, nb));
+      md5.getChars(line + 9);
+      data.println(line);
+      reportProgress(nb);
+      return true;
+    }
+  }
+  closeTransfer();
+  return false;
+}
+
+boolean FtpServer::doDelta()
+{
+  if (deltaRemain && deltaHdr[ 0 ] == 'C')
+  {
+    // Copy from the original file, one buffer per round
+    size_t nb = srcFile.readBytes(buf, deltaRemain < FTP_BUF_SIZE? deltaRemain : FTP_BUF_SIZE);
+    if (nb == 0) {
+      abortTransfer();
+      return false;
+    }
+    storeDelta(nb);
+    deltaRemain -= nb;
+    return true;
+  }
+  if (data.available())
+  {
+    int nb;
+    if (deltaRemain) {
+      // Literal data goes straight to the file
+      nb = data.read((uint8_t*) buf, deltaRemain < FTP_BUF_SIZE? deltaRemain : FTP_BUF_SIZE);
+      if (nb > 0) {
+        storeDelta(nb);
+        deltaRemain -= nb;
+      }
+    } else {
+      // Never read past the header, the opcode decides its length; until
+      // the opcode is in, read no more than the shortest header
+      uint8_t hdrSize = deltaHdrLen? deltaHdrSize(deltaHdr[ 0 ]) : 5;
+      nb = data.read(deltaHdr + deltaHdrLen, hdrSize - deltaHdrLen);
+      if (nb > 0)
+        deltaHdrLen += nb;
+      if (deltaHdrLen && deltaHdrLen == deltaHdrSize(deltaHdr[ 0 ])) {
+        deltaHdrLen = 0;
+        if (deltaHdr[ 0 ] == 'L')
+          deltaRemain = getU32(deltaHdr + 1);
+        else if (deltaHdr[ 0 ] == 'C') {
+          uint32_t index = getU32(deltaHdr + 1);
+          uint32_t count = getU32(deltaHdr + 5);
+          uint64_t pos = (uint64_t) index * deltaBlock;
+          uint64_t blocks = ((uint64_t) srcFile.size() + deltaBlock - 1) / deltaBlock;
+          if (count && ((uint64_t) index + count > blocks || !srcFile.seek(pos, SeekSet))) {
+            abortTransfer();
+            return false;
+          }
+          // Only the last block of the original may be short
+          uint64_t len = (uint64_t) count * deltaBlock;
+          deltaRemain = count? (len < srcFile.size() - pos? len : srcFile.size() - pos) : 0;
+        } else if (deltaHdr[ 0 ] == 'E') {
+          uint8_t digest[ 16 ];
+          deltaMd5.calculate();
+          deltaMd5.getBytes(digest);
+          if (getU32(deltaHdr + 1) != deltaSize || memcmp(digest, deltaHdr + 5, 16)) {
+            abortTransfer();
+            return false;
+          }
+          reportProgress(nb);
+          closeTransfer();
+          return false;
+        } else {
+          abortTransfer();
+          return false;
+        }
+      }
+    }
+    if (nb > 0)
+      reportProgress(nb);
+    return true;
+  }
+  if (data.connected())
+    return true;
+
+  // Closed before the end operation, the delta is incomplete
+  abortTransfer();
+  return false;
+}
+
+// Replace the delta upload target with the rebuilt temporary file
+//
+//  Replies 226 on success, or 451 telling where the data is left.
+
+void FtpServer::commitDelta()
+{
+  srcFile.close();
+  strcpy(pathBuf, deltaPath);
+  strcat(pathBuf, FTP_DELTA_SUFFIX);
+  statInvalidate(deltaPath);
+  if (!_fs.remove(deltaPath)) {
+    _fs.remove(pathBuf);
+    reply("451 Failed to replace " + String(deltaPath) + ", file unchanged");
+  } else if (!_fs.rename(pathBuf, deltaPath)) {
+    reply("451 Failed to rename, " + String(deltaPath) + " is now at " + String(pathBuf));
+  } else {
+    reply("226 File successfully transferred");
+  }
+}
+
+// Read a chunk of file into buf, converting bare LF line endings to CRLF
+//
+//  Reads up to len / 2 bytes (at least one), as each may expand to two.
+//  Raw data is staged in the upper half of buf and expanded forward into the
+//  start of buf; the output never overtakes the unread input, because each
+//  inserted CR is paid for by at least one staged byte already consumed.
+//  An existing CRLF is passed through, even if split across chunks.
+//
+//  return: number of bytes in buf, or the file read result if none
+
+int16_t FtpServer::readAscii(size_t len)
+{
+  char* in = buf + FTP_BUF_SIZE / 2;
+  int16_t nb = file.readBytes(in, len > 1? len / 2 : 1);
+  if (nb <= 0)
+    return nb;
+
+  char* end = in + nb;
+  char* out = buf;
+  while (in < end) {
+    char* lf = scanByte(in, end, '\n');
+    size_t run = lf - in;
+    if (run) {
+      memmove(out, in, run);
+      out += run;
+      lastCR = in[ run - 1 ] == '\r';
+    }
+    if (lf == end)
+      break;
+    if (!lastCR)
+      *out++ = '\r';
+    *out++ = '\n';
+    lastCR = false;
+    in = lf + 1;
+  }
+  return out - buf;
+}
+
+// Convert CRLF line endings in the first nb bytes of buf to LF, in place
+//
+//  A CR ending the chunk is held back until the next byte is known; a held
+//  CR not followed by LF is written out ahead of this chunk.
+//
+//  return: number of bytes left in buf
+
+size_t FtpServer::storeAscii(size_t nb)
+{
+  char* in = buf;
+  char* end = buf + nb;
+  char* out = buf;
+
+  if (pendingCR && *in != '\n')
+    file.write((uint8_t) '\r');
+  pendingCR = false;
+
+  while (in < end) {
+    char* cr = scanByte(in, end, '\r');
+    size_t run = cr - in;
+    if (run) {
+      memmove(out, in, run);
+      out += run;
+    }
+    if (cr == end)
+      break;
+    if (cr + 1 == end) {
+      pendingCR = true;
+      break;
+    }
+    if (cr[ 1 ] != '\n')
+      *out++ = '\r';
+    in = cr + 1;
+  }
+  return out - buf;
+}
+
 void FtpServer::closeTransfer()
 {
+  if (transferStatus == 2 && asciiMode && pendingCR)
+    file.write((uint8_t) '\r');
   file.close();
+  listDir = Dir();
   data.stop();
 
-  client.println("226 File successfully transferred");
+  if (_tracer)
+    _tracer->traceData(millis(), bytesTransfered, isUpload());
+  if (transferStatus == 4)
+    commitDelta();
+  else if (transferStatus == 5)
+    reply("226 " + String(listCount) + " matches total");
+  else
+    reply("226 File successfully transferred");
   transferStatus = 0;
+  if (_monitor)
+    _monitor->transferEnd(bytesTransfered, false);
 
   #ifdef FTP_DEBUG
-  uint32_t deltaT = time(NULL) - tsBeginTrans;
-  Serial.println("Data transfer closed (" + String(bytesTransfered) + " bytes, " + String(deltaT) + " seconds)") ;
+  uint32_t deltaT = millis() - tsBeginTrans;
+  Serial.println("Data transfer closed (" + String(bytesTransfered) + " bytes, " + String(deltaT) + " ms)") ;
   #endif
 }
 
@@ -677,16 +1260,95 @@ void FtpServer::abortTransfer()
   if (transferStatus > 0)
   {
     file.close();
+    listDir = Dir();
     data.stop();
-    client.println("426 Transfer aborted" );
+    if (transferStatus == 4) {
+      // Discard the partially rebuilt file
+      srcFile.close();
+      strcpy(pathBuf, deltaPath);
+      _fs.remove(strcat(pathBuf, FTP_DELTA_SUFFIX));
+    }
+    if (_tracer)
+      _tracer->traceData(millis(), bytesTransfered, isUpload());
+    reply("426 Transfer aborted" );
 
     transferStatus = 0;
+    if (_monitor)
+      _monitor->transferEnd(bytesTransfered, true);
     #ifdef FTP_DEBUG
     Serial.println("Transfer aborted!") ;
     #endif
   }
 }
 
+// Metadata cache
+//
+//  Entries seen by the last directory listing are kept, so that the SIZE,
+//  MDTM and existence probes sync clients send per file are answered
+//  without opening the file. Commands that change the file system
+//  invalidate affected entries; a path not found is not cached. Paths
+//  match regardless of case, so that no alias of a changed file on a
+//  case-insensitive file system survives invalidation.
+
+void FtpServer::statClear()
+{
+  statCount = 0;
+  statPoolLen = 0;
+}
+
+void FtpServer::statInsert(char const* path, size_t size, time_t mtime, bool isDir)
+{
+  size_t len = strlen(path) + 1;
+  if (statCount >= FTP_STAT_CACHE_SIZE || statPoolLen + len > FTP_STAT_POOL_SIZE)
+    return;
+
+  StatEntry& st = statCache[ statCount++ ];
+  st.hash = hashPath(path);
+  st.size = size;
+  st.mtime = mtime;
+  st.path = statPoolLen;
+  st.isDir = isDir;
+  memcpy(statPool + statPoolLen, path, len);
+  statPoolLen += len;
+}
+
+FtpServer::StatEntry const* FtpServer::statLookup(char const* path)
+{
+  uint32_t hash = hashPath(path);
+  for (uint8_t i = 0; i < statCount; i++)
+    if (statCache[ i ].hash == hash && !strcasecmp(statPool + statCache[ i ].path, path))
+      return &statCache[ i ];
+  return NULL;
+}
+
+// Drop the entry of path, and of anything below it
+
+void FtpServer::statInvalidate(char const* path)
+{
+  size_t len = strlen(path);
+  for (uint8_t i = 0; i < statCount; ) {
+    char const* entry = statPool + statCache[ i ].path;
+    if (!strncasecmp(entry, path, len) && (entry[ len ] == 0 || entry[ len ] == '/'))
+      statCache[ i ] = statCache[ --statCount ];  // path storage is reclaimed on clear
+    else
+      i++;
+  }
+}
+
+// Send a reply line to the client, and trace it if requested
+
+void FtpServer::reply(char const* line)
+{
+  client.println(line);
+  if (_tracer)
+    _tracer->traceReply(millis(), line);
+}
+
+void FtpServer::reply(String const& line)
+{
+  reply(line.c_str());
+}
+
 // Read a char from client connected to ftp server
 //
 //  update cmdLine and command buffers, iCL and parameters pointers
@@ -743,8 +1405,10 @@ int8_t FtpServer::readCmd()
           }
           else if (strlen(cmdLine) > 4)
             rc = -2; // Syntax error.
-          else
+          else {
             strcpy(command, cmdLine);
+            parameters = cmdLine + iCL;  // no parameters, point to empty string
+          }
           iCL = 0;
         }
       }
@@ -753,7 +1417,7 @@ int8_t FtpServer::readCmd()
         command[ i ] = toupper(command[ i ]);
     } else if (rc == -2) {
       iCL = 0;
-      client.println("500 Syntax error");
+      reply("500 Syntax error");
     }
   }
   return rc;
@@ -29,11 +29,16 @@
 // Uncomment to print debugging info to console attached to ESP8266
 //#define FTP_DEBUG
 
+// Uncomment to size file reads to the free TCP send window
+// (requires WiFiClient::availableForWrite() from the Arduino core)
+//#define FTP_WINDOWED_SEND
+
 #ifndef FTP_SERVERESP_H
 #define FTP_SERVERESP_H
 
 #include <FS.h>
 #include <ESP8266WiFi.h>
+#include <MD5Builder.h>
 
 #define FTP_SERVER_VERSION "0.1"
 
@@ -46,6 +51,12 @@
 #define FTP_FIL_SIZE 255               // Max size of a file name
 #define FTP_CMD_SIZE FTP_FIL_SIZE + 8  // Max size of a command
 #define FTP_BUF_SIZE 4096              // Size of file buffer for read/write
+#define FTP_DELTA_SUFFIX ".~dl"        // Suffix of temporary file for delta upload
+#define FTP_STAT_CACHE_SIZE 32         // Max number of entries in metadata cache
+#define FTP_STAT_POOL_SIZE 1024        // Bytes of path storage for metadata cache
+
+static_assert(FTP_STAT_CACHE_SIZE <= 255, "FTP_STAT_CACHE_SIZE must fit the uint8_t entry count");
+static_assert(FTP_STAT_POOL_SIZE <= 65535, "FTP_STAT_POOL_SIZE must fit the uint16_t pool offsets");
 
 class FtpServer {
 public:
@@ -67,12 +78,62 @@ protected:
   } Anonymous;
 
 public:
+  class Monitor {
+  public:
+    // Called when a file transfer begins
+    virtual void transferStart(char const* name, bool upload) {}
+    // Called after each chunk, with bytes so far and average rate in bytes/s
+    virtual void transferProgress(size_t bytes, uint32_t rate) {}
+    // Called when a file transfer completes or is aborted
+    virtual void transferEnd(size_t bytes, bool aborted) {}
+    // Return false to hold the transfer for now without dropping it
+    virtual bool transferReady() { return true; }
+  };
+
+  class Tracer {
+  public:
+    // Called for each command received, with millis() timestamp
+    virtual void traceCommand(uint32_t ts, char const* cmd, char const* params) {}
+    // Called for each reply line sent
+    virtual void traceReply(uint32_t ts, char const* line) {}
+    // Called when a file transfer ends, with the bytes moved
+    virtual void traceData(uint32_t ts, size_t bytes, bool upload) {}
+  };
+
+  // Writes traces as text lines, for replay with tools/ftp_replay.py
+  class StreamTracer: public Tracer {
+  public:
+    StreamTracer(Print& out) : _out(out) {}
+    void traceCommand(uint32_t ts, char const* cmd, char const* params) override {
+      // Do not record credentials
+      _out.printf("%lu C %s %s\n", (unsigned long) ts, cmd, strcmp(cmd, "PASS")? params : "****");
+    }
+    void traceReply(uint32_t ts, char const* line) override {
+      _out.printf("%lu R %s\n", (unsigned long) ts, line);
+    }
+    void traceData(uint32_t ts, size_t bytes, bool upload) override {
+      _out.printf("%lu D %c %lu\n", (unsigned long) ts, upload? 'U' : 'D', (unsigned long) bytes);
+    }
+  protected:
+    Print& _out;
+  };
+
+  enum FlushPolicy {
+    FLUSH_ON_CLOSE,                   // Sync uploads only on close, before the 226 reply
+    FLUSH_INTERVAL,                   // Also flush uploads every given number of bytes
+  };
+
   FtpServer(FS& fs, Auth& auth = Anonymous)
-  : _fs(fs), _auth(auth) {}
+  : _fs(fs), _auth(auth), _monitor(NULL), _tracer(NULL),
+    _flushPolicy(FLUSH_ON_CLOSE), _flushInterval(0) {}
 
   void    begin();
   void    handleFTP();
 
+  void    setFlushPolicy(FlushPolicy policy, size_t interval = 0);
+  void    setMonitor(Monitor* monitor);
+  void    setTracer(Tracer* tracer);
+
 private:
   void    iniVariables();
   void    clientConnected();
@@ -81,35 +142,85 @@ private:
   boolean userPassword();
   boolean processCommand();
   boolean dataConnect();
+  char const* resolvePath(char const* param);
+  void    startTransfer(int8_t status);
+  void    reportProgress(size_t nb);
   boolean doRetrieve();
   boolean doStore();
+  void    storeBytes(size_t nb);
+  void    storeDelta(size_t nb);
+  boolean doList();
+  boolean doSignature();
+  boolean doDelta();
+  void    commitDelta();
+  bool    isUpload() const { return transferStatus == 2 || transferStatus == 4; }
+  int16_t readAscii(size_t len);
+  size_t  storeAscii(size_t nb);
   void    closeTransfer();
   void    abortTransfer();
 
+  struct StatEntry {
+    uint32_t hash;                    // hash of path, for quick comparison
+    size_t   size;
+    time_t   mtime;
+    uint16_t path;                    // offset of path in statPool
+    bool     isDir;
+  };
+
+  void    statClear();
+  void    statInsert(char const* path, size_t size, time_t mtime, bool isDir);
+  StatEntry const* statLookup(char const* path);
+  void    statInvalidate(char const* path);
+
   int8_t  readCmd();
+  void    reply(char const* line);
+  void    reply(String const& line);
 
   FS& _fs;
   Auth& _auth;
+  Monitor* _monitor;
+  Tracer* _tracer;
+  FlushPolicy _flushPolicy;
+  size_t _flushInterval;
 
   WiFiClient client;
   WiFiClient data;
 
   File file;
+  File srcFile;                       // original file for delta upload
   Dir dir;
+  Dir listDir;                        // directory being listed
 
   char     buf[ FTP_BUF_SIZE ];       // data buffer for transfers
   char     cmdLine[ FTP_CMD_SIZE ];   // where to store incoming char from client
   char     command[ 5 ];              // command sent by client
-  String   renameFrom;                // previous rename-from command
+  char     pathBuf[ FTP_FIL_SIZE + 1 ];     // canonical path of current command
+  char     renameFrom[ FTP_FIL_SIZE + 1 ];  // previous rename-from command
   char *   parameters;                // point to begin of parameters sent by client
   uint16_t iCL;                       // pointer to cmdLine next incoming char
+  uint32_t restartPos;                // file offset requested by REST
+  char     listFormat;                // listing command: 'L'IST, 'M'LSD or 'N'LST
+  uint32_t listCount;                 // entries listed so far
+  size_t   unflushed;                 // bytes stored since the last flush
+  char     deltaPath[ FTP_FIL_SIZE + 1 ];   // target of delta upload
+  uint16_t deltaBlock;                // block size of signature / delta
+  uint32_t deltaRemain;               // bytes left in current delta operation
+  uint8_t  deltaHdr[ 21 ];            // delta operation header being received
+  uint8_t  deltaHdrLen;               // bytes of deltaHdr received
+  uint32_t deltaSize;                 // bytes of rebuilt file written so far
+  MD5Builder deltaMd5;                // digest of rebuilt file written so far
+  StatEntry statCache[ FTP_STAT_CACHE_SIZE ];  // metadata of recently listed entries
+  char     statPool[ FTP_STAT_POOL_SIZE ];    // paths of statCache entries
+  uint8_t  statCount;                 // entries in statCache
+  uint16_t statPoolLen;               // bytes used in statPool
   int8_t   cmdStatus,                 // status of ftp command connexion
            transferStatus;            // status of ftp data transfer
+  bool     asciiMode;                 // TYPE A in effect, translate line endings
+  bool     lastCR;                    // last byte sent in ASCII mode was a CR
+  bool     pendingCR;                 // CR held back at end of received chunk
   uint32_t tsEndConnection;           // projected timeout timestamp
-  #ifdef FTP_DEBUG
-  time_t   tsBeginTrans;              // store time of beginning of a transaction
+  uint32_t tsBeginTrans;              // store millis() at beginning of a transaction
   size_t   bytesTransfered;           // store total bytes transferred
-  #endif
 };
 
 #endif // FTP_SERVERESP_H
@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+#
+# Replay an FTP session trace, as recorded by FtpServer::StreamTracer,
+# against a running server and report per-command reply latencies.
+#
+# Trace lines are "<ms> C <cmd> <params>", "<ms> R <reply>" and
+# "<ms> D <U|D> <bytes>". Replies in the trace are only used for reference;
+# data transfers are reproduced using the recorded byte counts.
+#
+# Usage: ftp_replay.py [-p port] [-u user] [-w password] [--pace] host trace
+
+import argparse
+import hashlib
+import re
+import socket
+import struct
+import sys
+import time
+
+DOWNLOAD_CMDS = ('RETR', 'LIST', 'MLSD', 'NLST')
+DOWNLOAD_SITE_CMDS = ('SIGN',)
+UPLOAD_CMDS = ('STOR',)
+UPLOAD_SITE_CMDS = ('DELTA',)
+
+# Traces recorded on Serial are interleaved with the server's own messages
+TRACE_LINE = re.compile(r'^(\d+) ([CRD]) (.*)$')
+
+
+def transfer_kind(cmd, params):
+    """Return 'D' or 'U' for commands using the data connection, else None."""
+    if cmd == 'SITE':
+        sub = params.split(' ', 1)[0].upper()
+        if sub in DOWNLOAD_SITE_CMDS:
+            return 'D'
+        if sub in UPLOAD_SITE_CMDS:
+            return 'U'
+        return None
+    if cmd in DOWNLOAD_CMDS:
+        return 'D'
+    if cmd in UPLOAD_CMDS:
+        return 'U'
+    return None
+
+
+def load_trace(path):
+    cmds = []
+    with open(path) as f:
+        for line in f:
+            match = TRACE_LINE.match(line.rstrip('\r\n'))
+            if not match:
+                continue
+            ts, kind, rest = int(match.group(1)), match.group(2), match.group(3)
+            if kind == 'C':
+                cmd, _, params = rest.partition(' ')
+                cmds.append({'ts': ts, 'cmd': cmd, 'params': params, 'bytes': 0})
+            elif kind == 'D' and cmds:
+                # Attribute data volume to the most recent transfer command
+                for entry in reversed(cmds):
+                    if transfer_kind(entry['cmd'], entry['params']):
+                        entry['bytes'] = int(rest.split(' ')[1])
+                        break
+    return cmds
+
+
+class Session:
+    def __init__(self, host, port):
+        self.host = host
+        self.ctrl = socket.create_connection((host, port))
+        self.rfile = self.ctrl.makefile('r', encoding='latin-1', newline='\r\n')
+        self.data = None
+        self.pasv_port = None
+
+    def read_reply(self):
+        line = self.rfile.readline()
+        if not line:
+            raise EOFError('control connection closed')
+        code = line[:3]
+        while len(line) > 3 and line[3] == '-':
+            line = self.rfile.readline()
+            if not line or (line[:3] == code and line[3:4] == ' '):
+                break
+        return code, line.strip()
+
+    def send(self, cmd, params):
+        text = cmd + (' ' + params if params else '')
+        self.ctrl.sendall((text + '\r\n').encode('latin-1'))
+
+    def set_pasv(self, text):
+        fields = text[text.index('(') + 1:text.index(')')].split(',')
+        self.pasv_port = int(fields[4]) * 256 + int(fields[5])
+
+    def open_data(self):
+        # The server only accepts a data connection while handling the
+        # transfer command, but connects made earlier are queued
+        self.data = socket.create_connection((self.host, self.pasv_port))
+        self.pasv_port = None
+
+    def drain_data(self):
+        total = 0
+        while True:
+            chunk = self.data.recv(65536)
+            if not chunk:
+                break
+            total += len(chunk)
+        self.data.close()
+        self.data = None
+        return total
+
+    def fill_data(self, size, delta=False):
+        block = b'\0' * 4096
+        end = b''
+        if delta:
+            # Send the volume as one literal run and an end operation, so it
+            # forms a valid delta; the result is all zero bytes
+            size = max(0, size - 21)
+            out = 0
+            if size >= 5:
+                out = size - 5
+                self.data.sendall(b'L' + struct.pack('>I', out))
+            digest = hashlib.md5()
+            for n in range(out, 0, -len(block)):
+                digest.update(block[:min(n, len(block))])
+            end = b'E' + struct.pack('>I', out) + digest.digest()
+            size = out
+        while size > 0:
+            n = min(size, len(block))
+            self.data.sendall(block[:n])
+            size -= n
+        self.data.sendall(end)
+        self.data.close()
+        self.data = None
+
+
+def percentile(values, pct):
+    values = sorted(values)
+    idx = min(len(values) - 1, int(round(pct / 100.0 * (len(values) - 1))))
+    return values[idx]
+
+
+def replay(args):
+    cmds = load_trace(args.trace)
+    if not cmds:
+        sys.exit('No commands in trace')
+
+    latencies = {}
+    sess = Session(args.host, args.port)
+    start = time.monotonic()
+    sess.read_reply()
+
+    for i, entry in enumerate(cmds):
+        if args.pace and i > 0:
+            gap = (entry['ts'] - cmds[i - 1]['ts']) / 1000.0
+            if gap > 0:
+                time.sleep(gap)
+
+        cmd, params = entry['cmd'], entry['params']
+        if cmd == 'USER' and args.user is not None:
+            params = args.user
+        elif cmd == 'PASS':
+            params = args.password
+
+        kind = transfer_kind(cmd, params)
+        sent = time.monotonic()
+        sess.send(cmd, params)
+        if kind and sess.pasv_port is not None:
+            sess.open_data()
+        code, text = sess.read_reply()
+        label = cmd if cmd != 'SITE' else 'SITE ' + params.split(' ', 1)[0].upper()
+        latencies.setdefault(label, []).append(time.monotonic() - sent)
+
+        if cmd == 'PASV' and code == '227':
+            sess.set_pasv(text)
+        if code == '150' and sess.data is not None:
+            if kind == 'U':
+                sess.fill_data(entry['bytes'], delta=(cmd == 'SITE'))
+            else:
+                sess.drain_data()
+            sess.read_reply()
+        elif sess.data is not None:
+            sess.data.close()
+            sess.data = None
+        if cmd == 'QUIT':
+            break
+
+    elapsed = time.monotonic() - start
+    sess.ctrl.close()
+
+    print('%-10s %6s %9s %9s %9s %9s' % ('CMD', 'COUNT', 'P50(ms)', 'P90(ms)', 'P99(ms)', 'MAX(ms)'))
+    for cmd in sorted(latencies):
+        values = [v * 1000.0 for v in latencies[cmd]]
+        print('%-10s %6d %9.1f %9.1f %9.1f %9.1f' % (
+            cmd, len(values), percentile(values, 50), percentile(values, 90),
+            percentile(values, 99), max(values)))
+    print('Session time: %.3f s' % elapsed)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Replay an FTP session trace')
+    parser.add_argument('-p', '--port', type=int, default=21)
+    parser.add_argument('-u', '--user', help='override the traced user name')
+    parser.add_argument('-w', '--password', default='',
+                        help='password to send, as traces do not record it')
+    parser.add_argument('--pace', action='store_true',
+                        help='keep the recorded delays between commands')
+    parser.add_argument('host')
+    parser.add_argument('trace')
+    replay(parser.parse_args())
+
+
+if __name__ == '__main__':
+    main()